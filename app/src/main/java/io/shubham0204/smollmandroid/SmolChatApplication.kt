@@ -17,6 +17,7 @@
 package io.shubham0204.smollmandroid
 
 import android.app.Application
+import io.shubham0204.smollm.SmolLM
 import org.koin.android.ext.koin.androidContext
 import org.koin.core.context.startKoin
 import org.koin.ksp.generated.module
@@ -28,5 +29,17 @@ class SmolChatApplication : Application() {
             androidContext(this@SmolChatApplication)
             modules(KoinAppModule().module)
         }
+        // keep a closed model loaded so that switching between chats using
+        // the same model only creates a new context
+        SmolLM.setModelCacheBudget(MODEL_CACHE_BUDGET_BYTES)
+    }
+
+    override fun onTrimMemory(level: Int) {
+        super.onTrimMemory(level)
+        SmolLM.trimModelCache()
+    }
+
+    companion object {
+        private const val MODEL_CACHE_BUDGET_BYTES = 1024L * 1024L * 1024L
     }
 }
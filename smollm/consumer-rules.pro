@@ -0,0 +1,3 @@
+
+# SmolLM.LoadProgressListener.onProgress is invoked from native code
+-keep interface io.shubham0204.smollm.SmolLM$LoadProgressListener { *; }
@@ -17,7 +17,11 @@
 package io.shubham0204.smollm
 
 import androidx.test.ext.junit.runners.AndroidJUnit4
+import kotlinx.coroutines.CancellationException
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.cancel
 import kotlinx.coroutines.flow.toList
+import kotlinx.coroutines.launch
 import kotlinx.coroutines.test.runTest
 import org.junit.After
 import org.junit.Before
@@ -72,6 +76,247 @@ class SmolLMTest {
             assert(speedAfterPrediction > 0)
         }
 
+    @Test
+    fun load_reportsProgress() =
+        runTest {
+            // free the model loaded in `setup` so that it is loaded from the disk again
+            smolLM.close()
+            SmolLM.setModelCacheBudget(0)
+            for ((prefetchWeights, warmup) in listOf(true to true, false to false)) {
+                val progressValues = mutableListOf<Float>()
+                val otherSmolLM = SmolLM()
+                otherSmolLM.load(
+                    modelPath,
+                    SmolLM.InferenceParams(
+                        minP,
+                        temperature,
+                        storeChats = true,
+                        contextSize = 0,
+                        chatTemplate,
+                        prefetchWeights = prefetchWeights,
+                        warmup = warmup,
+                    ),
+                    onProgress = { progressValues.add(it) },
+                )
+                val response = otherSmolLM.getResponse(query)
+                otherSmolLM.close()
+                assert(progressValues.size > 1)
+                assert(progressValues.zipWithNext().all { (prev, next) -> next >= prev })
+                assert(progressValues.last() == 1.0f)
+                assert(response.isNotEmpty())
+            }
+        }
+
+    @Test
+    fun load_cancellation_throwsCancellationException() =
+        runTest {
+            smolLM.close()
+            SmolLM.setModelCacheBudget(0)
+            val otherSmolLM = SmolLM()
+            var exception: Throwable? = null
+            val job =
+                launch(Dispatchers.IO) {
+                    try {
+                        // cancel the load from its first progress update
+                        otherSmolLM.load(modelPath, onProgress = { coroutineContext.cancel() })
+                    } catch (e: Throwable) {
+                        exception = e
+                    }
+                }
+            job.join()
+            otherSmolLM.close()
+            assert(exception is CancellationException)
+        }
+
+    @Test
+    fun getResponse_multipleTurns_works() =
+        runTest {
+            // the second and third queries are formatted incrementally against the chat history
+            repeat(3) {
+                val response = smolLM.getResponse(query)
+                assert(response.isNotEmpty())
+            }
+            assert(smolLM.getContextLengthUsed() > 0)
+        }
+
+    @Test
+    fun incrementalPrompt_matchesCompleteFormatting() =
+        runTest {
+            // chatml (the default chat-template) and llama3
+            for (template in listOf(SmolLM.DefaultInferenceParams.chatTemplate, chatTemplate)) {
+                val chatSmolLM = SmolLM()
+                chatSmolLM.load(
+                    modelPath,
+                    SmolLM.InferenceParams(
+                        storeChats = true,
+                        contextSize = 0,
+                        chatTemplate = template,
+                        samplerParams = SmolLM.SamplerParams(greedy = true),
+                    ),
+                )
+                chatSmolLM.addSystemPrompt(systemPrompt)
+                val roles = mutableListOf("system")
+                val contents = mutableListOf(systemPrompt)
+                repeat(3) { turn ->
+                    val query = "$query ($turn)"
+                    val history = chatSmolLM.formatChat(template, roles, contents, false)
+                    roles.add("user")
+                    contents.add(query)
+                    val complete = chatSmolLM.formatChat(template, roles, contents, true)
+                    val response = chatSmolLM.getResponse(query)
+                    // the first prompt formats the complete chat, the following ones are
+                    // formatted incrementally and should match the delta of the complete chat
+                    val expectedPrompt = if (turn == 0) complete else complete.substring(history.length)
+                    assert(chatSmolLM.getLastPrompt() == expectedPrompt)
+                    roles.add("assistant")
+                    contents.add(response)
+                }
+                chatSmolLM.close()
+            }
+        }
+
+    @Test
+    fun sharedModel_works() =
+        runTest {
+            // loads the same model as `smolLM`, which is shared through the native model registry
+            // a shared model is not loaded from the disk, hence the only progress reported is 1.0
+            val progressValues = mutableListOf<Float>()
+            val otherSmolLM = SmolLM()
+            otherSmolLM.load(
+                modelPath,
+                SmolLM.InferenceParams(minP, temperature, storeChats = true, contextSize = 0, chatTemplate),
+                onProgress = { progressValues.add(it) },
+            )
+            assert(progressValues == listOf(1.0f))
+            val response = otherSmolLM.getResponse(query)
+            otherSmolLM.close()
+            assert(response.isNotEmpty())
+            // `smolLM` should remain usable after the other instance is closed
+            assert(smolLM.getResponseAsFlow(query).toList().isNotEmpty())
+        }
+
+    @Test
+    fun sharedModel_listenerThrows_releasesModel() =
+        runTest {
+            // the exception thrown for the shared model's only progress update aborts the load
+            val otherSmolLM = SmolLM()
+            val exception =
+                runCatching {
+                    otherSmolLM.load(
+                        modelPath,
+                        SmolLM.InferenceParams(minP, temperature, storeChats = true, contextSize = 0, chatTemplate),
+                        onProgress = { throw IllegalStateException("aborted by the listener") },
+                    )
+                }.exceptionOrNull()
+            assert(exception?.message == "aborted by the listener")
+            otherSmolLM.close()
+            // the registry's reference taken for the aborted load is released, `smolLM` keeps the model
+            assert(smolLM.getResponseAsFlow(query).toList().isNotEmpty())
+        }
+
+    @Test
+    fun seededSampling_isReproducible() =
+        runTest {
+            // the first params are sampled with the fused sampler,
+            // the second ones (penalties, top-p) with llama.cpp's sampler chain
+            for (samplerParams in
+                listOf(
+                    SmolLM.SamplerParams(minP, temperature, seed = 42),
+                    SmolLM.SamplerParams(
+                        minP,
+                        temperature,
+                        topP = 0.9f,
+                        repeatPenalty = 1.1f,
+                        frequencyPenalty = 0.1f,
+                        seed = 42,
+                    ),
+                )) {
+                assertSeededResponsesEqual(samplerParams)
+            }
+        }
+
+    @Test
+    fun setSamplerParams_invalidParams_throws() {
+        for (samplerParams in
+            listOf(
+                SmolLM.SamplerParams(mirostat = 3),
+                SmolLM.SamplerParams(topK = -1, greedy = true),
+                SmolLM.SamplerParams(minP = -0.1f),
+            )) {
+            val exception = runCatching { smolLM.setSamplerParams(samplerParams) }.exceptionOrNull()
+            assert(exception is IllegalArgumentException)
+        }
+        // the previous sampler is retained
+        assert(smolLM.getResponse(query).isNotEmpty())
+    }
+
+    @Test
+    fun load_invalidSamplerParams_throws() =
+        runTest {
+            val otherSmolLM = SmolLM()
+            val exception =
+                runCatching {
+                    otherSmolLM.load(
+                        modelPath,
+                        SmolLM.InferenceParams(
+                            contextSize = 0,
+                            chatTemplate = chatTemplate,
+                            samplerParams = SmolLM.SamplerParams(mirostat = 3),
+                        ),
+                    )
+                }.exceptionOrNull()
+            assert(exception is IllegalArgumentException)
+            // the failed load released its model, the instance can be loaded again
+            otherSmolLM.load(modelPath, SmolLM.InferenceParams(contextSize = 0, chatTemplate = chatTemplate))
+            assert(otherSmolLM.getResponse(query).isNotEmpty())
+            otherSmolLM.close()
+        }
+
+    private suspend fun assertSeededResponsesEqual(samplerParams: SmolLM.SamplerParams) {
+        val responses =
+            List(2) {
+                val seededSmolLM = SmolLM()
+                seededSmolLM.load(
+                    modelPath,
+                    SmolLM.InferenceParams(
+                        storeChats = false,
+                        contextSize = 0,
+                        chatTemplate = chatTemplate,
+                        samplerParams = samplerParams,
+                    ),
+                )
+                val response = seededSmolLM.getResponse(query)
+                seededSmolLM.close()
+                response
+            }
+        assert(responses[0] == responses[1])
+    }
+
+    @Test
+    fun load_withAndWithoutRepacking_works() =
+        runTest {
+            // only checks that both settings load and respond, the weights of the q8_0 test model
+            // are not repacked by llama.cpp (only Q4_0/IQ4_NL, and Q4_K on x86, are)
+            val responses =
+                listOf(true, false).map { repackWeights ->
+                    val otherSmolLM = SmolLM()
+                    otherSmolLM.load(
+                        modelPath,
+                        SmolLM.InferenceParams(
+                            storeChats = false,
+                            contextSize = 0,
+                            chatTemplate = chatTemplate,
+                            repackWeights = repackWeights,
+                            samplerParams = SmolLM.SamplerParams(greedy = true),
+                        ),
+                    )
+                    val response = otherSmolLM.getResponse(query)
+                    otherSmolLM.close()
+                    response
+                }
+            assert(responses.all { it.isNotEmpty() })
+        }
+
     @Test
     fun getContextSize_works() =
         runTest {
@@ -3,15 +3,93 @@
 #include <cstring>
 #include <iostream>
 #include <fstream>
+#include "ModelRegistry.h"
 #include "mtmd-helper.h"
 
 #define TAG "[SmolLMAndroid-Cpp]"
 #define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
 #define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
 
+// forwards llama.cpp's errors and warnings to logcat, along with the buffer types chosen for the
+// model's weights e.g. 'CPU_REPACK model buffer size = ...', other info and debug logs are dropped
+static void
+forwardLlamaLog(ggml_log_level level, std::string &line) {
+    if (!line.empty() && line.back() == '\n') {
+        line.pop_back();
+    }
+    if (level == GGML_LOG_LEVEL_ERROR) {
+        LOGe("%s", line.c_str());
+    } else if (level == GGML_LOG_LEVEL_WARN ||
+               (level == GGML_LOG_LEVEL_INFO && line.find("model buffer size") != std::string::npos)) {
+        LOGi("%s", line.c_str());
+    }
+    line.clear();
+}
+
+static void
+llamaLogCallback(ggml_log_level level, const char *text, void * /*userData*/) {
+    // GGML_LOG_LEVEL_CONT continues the message of the previous call with its level,
+    // hence the parts of a message are collected and forwarded once the line is complete
+    thread_local std::string    line;
+    thread_local ggml_log_level lineLevel = GGML_LOG_LEVEL_NONE;
+    if (level != GGML_LOG_LEVEL_CONT) {
+        if (!line.empty()) {
+            forwardLlamaLog(lineLevel, line);
+        }
+        lineLevel = level;
+    }
+    line += text;
+    if (!line.empty() && line.back() == '\n') {
+        forwardLlamaLog(lineLevel, line);
+    }
+}
+
+// logs the extra buffer types (e.g. CPU_REPACK) that the CPU backend
+// offers to llama.cpp for the model's weights
+static void
+logCPUExtraBufferTypes() {
+    ggml_backend_dev_t cpuDevice = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!cpuDevice) return;
+    ggml_backend_reg_t cpuReg = ggml_backend_dev_backend_reg(cpuDevice);
+    auto getExtraBufts = (ggml_backend_dev_get_extra_bufts_t) ggml_backend_reg_get_proc_address(
+            cpuReg, "ggml_backend_dev_get_extra_bufts");
+    if (!getExtraBufts) {
+        LOGi("CPU backend has no extra buffer types");
+        return;
+    }
+    for (ggml_backend_buffer_type_t *buft = getExtraBufts(cpuDevice); buft && *buft; ++buft) {
+        LOGi("CPU backend extra buffer type: %s", ggml_backend_buft_name(*buft));
+    }
+}
+
+void
+LLMInference::_warmup() {
+    const llama_vocab *vocab = llama_model_get_vocab(_model);
+    std::vector<llama_token> tokens;
+    llama_token bos = llama_vocab_bos(vocab);
+    llama_token eos = llama_vocab_eos(vocab);
+    if (bos != LLAMA_TOKEN_NULL) tokens.push_back(bos);
+    if (eos != LLAMA_TOKEN_NULL) tokens.push_back(eos);
+    if (tokens.empty()) tokens.push_back(0);
+
+    auto start = ggml_time_us();
+    llama_set_warmup(_ctx, true);
+    if (llama_model_has_decoder(_model)) {
+        if (llama_decode(_ctx, llama_batch_get_one(tokens.data(), (int32_t) tokens.size())) < 0) {
+            LOGe("warmup: llama_decode() failed");
+        }
+    }
+    llama_memory_clear(llama_get_memory(_ctx), true);
+    llama_synchronize(_ctx);
+    llama_set_warmup(_ctx, false);
+    LOGi("warmup: completed in %ld ms", (long) ((ggml_time_us() - start) / 1000));
+}
+
 void
 LLMInference::loadModel(const char *model_path, float minP, float temperature, bool storeChats, long contextSize,
-                        const char *chatTemplate, int nThreads, bool useMmap, bool useMlock) {
+                        const char *chatTemplate, int nThreads, bool useMmap, bool useMlock, bool repackWeights,
+                        bool prefetch, bool warmup, llama_progress_callback progressCallback,
+                        void *progressCallbackUserData) {
     LOGi("loading model with"
          "\n\tmodel_path = %s"
          "\n\tminP = %f"
@@ -21,15 +99,26 @@ LLMInference::loadModel(const char *model_path, float minP, float temperature, b
          "\n\tchatTemplate = %s"
          "\n\tnThreads = %d"
          "\n\tuseMmap = %d"
-         "\n\tuseMlock = %d",
-         model_path, minP, temperature, storeChats, contextSize, chatTemplate, nThreads, useMmap, useMlock);
-
+         "\n\tuseMlock = %d"
+         "\n\trepackWeights = %d"
+         "\n\tprefetch = %d"
+         "\n\twarmup = %d",
+         model_path, minP, temperature, storeChats, contextSize, chatTemplate, nThreads, useMmap, useMlock,
+         repackWeights, prefetch, warmup);
+
+    llama_log_set(llamaLogCallback, nullptr);
     ggml_backend_load_all();
+    if (repackWeights) {
+        logCPUExtraBufferTypes();
+    }
 
     llama_model_params model_params = llama_model_default_params();
     model_params.use_mmap = useMmap;
     model_params.use_mlock = useMlock;
-    _model = llama_model_load_from_file(model_path, model_params);
+    model_params.use_extra_bufts = repackWeights;
+    model_params.progress_callback = progressCallback;
+    model_params.progress_callback_user_data = progressCallbackUserData;
+    _model = ModelRegistry::getInstance().acquire(model_path, model_params, prefetch);
     if (!_model) {
         LOGe("failed to load model from %s", model_path);
         throw std::runtime_error("loadModel() failed");
@@ -46,28 +135,121 @@ LLMInference::loadModel(const char *model_path, float minP, float temperature, b
         throw std::runtime_error("llama_new_context_with_model() returned null");
     }
 
-    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
-    sampler_params.no_perf = true;
-    _sampler = llama_sampler_chain_init(sampler_params);
-    llama_sampler_chain_add(_sampler, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_min_p(minP, 1));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    if (warmup) {
+        _warmup();
+    }
+
+    SamplerParams samplerParams;
+    samplerParams.minP = minP;
+    samplerParams.temperature = temperature;
+    setSamplerParams(samplerParams);
 
     _formattedMessages = std::vector<char>(llama_n_ctx(_ctx));
     _messages.clear();
+    _messageArena.clear();
+    _numFormattedMessages = 0;
 
     if (chatTemplate == nullptr) {
         _chatTemplate = llama_model_chat_template(_model, nullptr);
     } else {
         _chatTemplate = strdup(chatTemplate);
     }
+    _isTemplateIncremental = _chatTemplate != nullptr && _checkTemplateIncremental();
+    LOGi("chat-template supports incremental formatting: %d", _isTemplateIncremental);
     this->_storeChats = storeChats;
 }
 
+void
+LLMInference::setSamplerParams(const SamplerParams &params) {
+    LOGi("setting sampler params with"
+         "\n\tminP = %f"
+         "\n\ttemperature = %f"
+         "\n\ttopK = %d"
+         "\n\ttopP = %f"
+         "\n\ttypicalP = %f"
+         "\n\tpenaltyLastN = %d"
+         "\n\trepeatPenalty = %f"
+         "\n\tfrequencyPenalty = %f"
+         "\n\tpresencePenalty = %f"
+         "\n\tmirostat = %d"
+         "\n\tseed = %u"
+         "\n\tgreedy = %d",
+         params.minP, params.temperature, params.topK, params.topP, params.typicalP, params.penaltyLastN,
+         params.repeatPenalty, params.frequencyPenalty, params.presencePenalty, params.mirostat, params.seed,
+         params.greedy);
+    params.validate();
+    if (_sampler) llama_sampler_free(_sampler);
+    _samplerParams = params;
+    _sampler = createSamplerChain(_model, params);
+    if (params.supportsFusedSampling()) {
+        _fusedSampler = std::make_unique<FusedSampler>(params);
+    } else {
+        _fusedSampler.reset();
+    }
+    LOGi("using fused sampler: %d", _fusedSampler != nullptr);
+}
+
 void
 LLMInference::addChatMessage(const char *message, const char *role) {
-    _messages.push_back({strdup(role), strdup(message)});
+    _messages.push_back({_messageArena.store(role), _messageArena.store(message)});
+}
+
+int
+LLMInference::_applyTemplate(const llama_chat_message *messages, size_t count, bool addAssistant) {
+    int len = llama_chat_apply_template(_chatTemplate, messages, count, addAssistant, _formattedMessages.data(),
+                                        _formattedMessages.size());
+    if (len > (int) _formattedMessages.size()) {
+        // the buffer is retained across calls, so it is grown only
+        // when the formatted string exceeds the largest one seen so far
+        _formattedMessages.resize(len);
+        len = llama_chat_apply_template(_chatTemplate, messages, count, addAssistant, _formattedMessages.data(),
+                                        _formattedMessages.size());
+    }
+    return len;
+}
+
+bool
+LLMInference::_formatNewMessages(size_t from, std::string &prompt) {
+    const llama_chat_message *window = _messages.data() + from - 1;
+    int prevMessageLen = _applyTemplate(window, 1, false);
+    if (prevMessageLen < 0) {
+        throw std::runtime_error("llama_chat_apply_template() failed");
+    }
+    std::string prevMessage(_formattedMessages.begin(), _formattedMessages.begin() + prevMessageLen);
+    int windowLen = _applyTemplate(window, _messages.size() - from + 1, true);
+    if (windowLen < prevMessageLen) {
+        throw std::runtime_error("llama_chat_apply_template() failed");
+    }
+    if (prevMessage.compare(0, prevMessageLen, _formattedMessages.data(), prevMessageLen) != 0) {
+        return false;
+    }
+    prompt.assign(_formattedMessages.begin() + prevMessageLen, _formattedMessages.begin() + windowLen);
+    return true;
+}
+
+bool
+LLMInference::_checkTemplateIncremental() {
+    const llama_chat_message probe[] = {
+        {"system", "You are a helpful assistant"},
+        {"user", "Hello"},
+        {"assistant", "Hi there"},
+        {"user", "How are you?"},
+    };
+    auto format = [this](const llama_chat_message *messages, size_t count, bool addAssistant, std::string &out) {
+        int len = _applyTemplate(messages, count, addAssistant);
+        if (len < 0) return false;
+        out.assign(_formattedMessages.begin(), _formattedMessages.begin() + len);
+        return true;
+    };
+    std::string complete, history, prevMessage, window;
+    if (!format(probe, 4, true, complete) || !format(probe, 3, false, history) ||
+        !format(probe + 2, 1, false, prevMessage) || !format(probe + 2, 2, true, window)) {
+        return false;
+    }
+    if (window.compare(0, prevMessage.size(), prevMessage) != 0) {
+        return false;
+    }
+    return complete == history + window.substr(prevMessage.size());
 }
 
 float
@@ -80,27 +262,41 @@ LLMInference::getContextSizeUsed() const {
     return _nCtxUsed;
 }
 
+const std::string &
+LLMInference::getLastPrompt() const {
+    return _lastPrompt;
+}
+
 void
 LLMInference::startCompletion(const char *query) {
     if (!_storeChats) {
         _prevLen = 0;
-        _formattedMessages.clear();
-        _formattedMessages = std::vector<char>(llama_n_ctx(_ctx));
+        _numFormattedMessages = 0;
     }
     _responseGenerationTime = 0;
     _responseNumTokens = 0;
     addChatMessage(query, "user");
-    int newLen = llama_chat_apply_template(_chatTemplate, _messages.data(), _messages.size(), true,
-                                           _formattedMessages.data(), _formattedMessages.size());
-    if (newLen > (int) _formattedMessages.size()) {
-        _formattedMessages.resize(newLen);
-        newLen = llama_chat_apply_template(_chatTemplate, _messages.data(), _messages.size(), true,
-                                           _formattedMessages.data(), _formattedMessages.size());
-    }
-    if (newLen < 0) {
-        throw std::runtime_error("llama_chat_apply_template() failed");
+    std::string &prompt = _lastPrompt;
+    if (_isTemplateIncremental && _numFormattedMessages > 0 && !_formatNewMessages(_numFormattedMessages, prompt)) {
+        // the rendering of the window does not begin with the rendering of its first message, hence
+        // stripping it would produce a wrong prompt. This check is weaker than the probe at load-time
+        // (it does not compare against the delta of the complete chat, which would need a full render)
+        // but catches templates whose rendering of a message depends on the messages following it.
+        // Fall back to formatting the complete chat for the rest of the conversation
+        LOGe("rendering of the new messages does not begin with the previous message, formatting the complete chat");
+        _isTemplateIncremental = false;
+        _prevLen = _applyTemplate(_messages.data(), _numFormattedMessages, false);
+        if (_prevLen < 0) {
+            throw std::runtime_error("llama_chat_apply_template() failed");
+        }
+    }
+    if (!_isTemplateIncremental || _numFormattedMessages == 0) {
+        int newLen = _applyTemplate(_messages.data(), _messages.size(), true);
+        if (newLen < 0) {
+            throw std::runtime_error("llama_chat_apply_template() failed");
+        }
+        prompt.assign(_formattedMessages.begin() + _prevLen, _formattedMessages.begin() + newLen);
     }
-    std::string prompt(_formattedMessages.begin() + _prevLen, _formattedMessages.begin() + newLen);
     _promptTokens = common_tokenize(llama_model_get_vocab(_model), prompt, true, true);
 
     if (_batch) {
@@ -149,7 +345,12 @@ LLMInference::completionLoop() {
         }
     }
 
-    _currToken = llama_sampler_sample(_sampler, _ctx, -1);
+    if (_fusedSampler) {
+        _currToken = _fusedSampler->sample(llama_get_logits_ith(_ctx, -1),
+                                           llama_vocab_n_tokens(llama_model_get_vocab(_model)));
+    } else {
+        _currToken = llama_sampler_sample(_sampler, _ctx, -1);
+    }
     if (llama_vocab_is_eog(llama_model_get_vocab(_model), _currToken)) {
         addChatMessage(_response.c_str(), "assistant");
         _response.clear();
@@ -182,26 +383,30 @@ LLMInference::stopCompletion() {
     }
     _response.clear();
     if (!is_multimodal_model && _chatTemplate) {
-        _prevLen = llama_chat_apply_template(_chatTemplate, _messages.data(), _messages.size(), false, nullptr, 0);
-        if (_prevLen < 0) {
-            throw std::runtime_error("llama_chat_apply_template() failed");
+        if (_isTemplateIncremental) {
+            // the next prompt is formatted against the last message,
+            // the complete chat history need not be formatted here
+            _numFormattedMessages = _messages.size();
+        } else {
+            _prevLen = llama_chat_apply_template(_chatTemplate, _messages.data(), _messages.size(), false, nullptr, 0);
+            if (_prevLen < 0) {
+                throw std::runtime_error("llama_chat_apply_template() failed");
+            }
         }
     }
 }
 
 LLMInference::~LLMInference() {
-    for (llama_chat_message &message: _messages) {
-        free(const_cast<char *>(message.role));
-        free(const_cast<char *>(message.content));
-    }
     if (_ctx) llama_free(_ctx);
-    if (_model) llama_model_free(_model);
     if (_batch) {
         llama_batch_free(*_batch);
         delete _batch;
     }
     if (_sampler) llama_sampler_free(_sampler);
     if (_mtmd_ctx) mtmd_free(_mtmd_ctx);
+    // the model is shared with other instances through the registry
+    // and is freed by it once it is no longer referenced
+    if (_model) ModelRegistry::getInstance().release(_model);
 }
 
 // ========== MULTIMODAL IMPLEMENTATION ==========
@@ -213,7 +418,7 @@ bool LLMInference::loadMultimodalModel(const char* model_path, const char* mmpro
 
     llama_model_params model_params = llama_model_default_params();
     model_params.n_gpu_layers = n_gpu_layers;
-    _model = llama_model_load_from_file(model_path, model_params);
+    _model = ModelRegistry::getInstance().acquire(model_path, model_params, false);
     if (!_model) return false;
 
     mtmd_context_params mparams = mtmd_context_params_default();
@@ -228,15 +433,14 @@ bool LLMInference::loadMultimodalModel(const char* model_path, const char* mmpro
     _ctx = llama_init_from_model(_model, ctx_params);
     if (!_ctx) return false;
 
-    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
-    _sampler = llama_sampler_chain_init(sampler_params);
-    llama_sampler_chain_add(_sampler, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_min_p(minP, 1));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    SamplerParams samplerParams;
+    samplerParams.minP = minP;
+    samplerParams.temperature = temperature;
+    setSamplerParams(samplerParams);
 
     _formattedMessages = std::vector<char>(llama_n_ctx(_ctx));
     _messages.clear();
+    _messageArena.clear();
     _chatTemplate = llama_model_chat_template(_model, nullptr);
     _storeChats   = false;
     is_multimodal_model = true;
@@ -258,6 +462,7 @@ bool LLMInference::buildMultimodalChat(const char* text_prompt) {
 
     llama_memory_clear(llama_get_memory(_ctx), false);
     _messages.clear();
+    _messageArena.clear();
     _response.clear();
     _cacheResponseTokens.clear();
 
@@ -270,13 +475,7 @@ bool LLMInference::buildMultimodalChat(const char* text_prompt) {
     addChatMessage(user_content.c_str(), "user");
 
     // Apply chat template
-    int newLen = llama_chat_apply_template(_chatTemplate, _messages.data(), _messages.size(), true,
-                                           _formattedMessages.data(), _formattedMessages.size());
-    if (newLen > (int) _formattedMessages.size()) {
-        _formattedMessages.resize(newLen);
-        newLen = llama_chat_apply_template(_chatTemplate, _messages.data(), _messages.size(), true,
-                                           _formattedMessages.data(), _formattedMessages.size());
-    }
+    int newLen = _applyTemplate(_messages.data(), _messages.size(), true);
     if (newLen < 0) return false;
 
     std::string full_prompt(_formattedMessages.begin(), _formattedMessages.begin() + newLen);
@@ -2,6 +2,9 @@
 #include "llama.h"
 #include "common.h"
 #include "mtmd.h"
+#include "MessageArena.h"
+#include "Sampler.h"
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -10,20 +13,33 @@ class LLMInference {
     llama_context* _ctx = nullptr;
     llama_model*   _model = nullptr;
     llama_sampler* _sampler = nullptr;
+    // set when `_samplerParams` can be sampled without the sampler chain
+    std::unique_ptr<FusedSampler> _fusedSampler;
+    SamplerParams                 _samplerParams;
     llama_token    _currToken = 0;
     llama_batch*   _batch = nullptr;
     mtmd_context*  _mtmd_ctx = nullptr;
 
     // container to store user/assistant messages in the chat
+    // the role and content of each message are owned by `_messageArena`
     std::vector<llama_chat_message> _messages;
-    // stores the string generated after applying
-    // the chat-template to all messages in `_messages`
+    MessageArena                    _messageArena;
+    // buffer in which the chat-template is applied to the messages
     std::vector<char> _formattedMessages;
     // stores the tokens for the last query
     // appended to `_messages`
     std::vector<llama_token> _promptTokens;
     int                      _prevLen = 0;
     const char*              _chatTemplate = nullptr;
+    // whether the chat-template renders a message independently of the messages
+    // preceding it (except for the one message immediately before), in which case
+    // the prompt for a new query is formatted from the new messages only
+    bool _isTemplateIncremental = false;
+    // number of messages in `_messages` that have been formatted and decoded
+    size_t _numFormattedMessages = 0;
+
+    // the prompt formatted in the last call to `startCompletion`
+    std::string _lastPrompt;
 
     // stores the complete response for the given query
     std::string _response;
@@ -40,6 +56,23 @@ class LLMInference {
 
     bool _isValidUtf8(const char* response);
 
+    // applies the chat-template to `count` messages, storing the result in `_formattedMessages`
+    // returns the length of the formatted string, or a negative value if the template could not be applied
+    int _applyTemplate(const llama_chat_message* messages, size_t count, bool addAssistant);
+
+    // formats the messages from index `from` onwards by rendering them after the message at `from - 1`
+    // and stripping the rendering of that message, avoiding to format the complete chat history
+    // returns false if the rendering of the window does not begin with the rendering of that message alone,
+    // this does not verify that the result equals the delta of the complete chat (see `_checkTemplateIncremental`)
+    bool _formatNewMessages(size_t from, std::string& prompt);
+
+    // checks whether `_formatNewMessages` produces the same prompt as formatting the complete chat
+    bool _checkTemplateIncremental();
+
+    // runs a single decode over BOS/EOS tokens to touch all weights
+    // and initialize the compute buffers, then clears the KV cache
+    void _warmup();
+
     // ========== VIDEO CAPTIONING (NEW) ==========
 private:
     struct ImageFrame {
@@ -52,8 +85,18 @@ private:
 
 public:
     // ========== EXISTING METHODS ==========
+    // `repackWeights` allows llama.cpp to repack supported quantized weights in the
+    // interleaved layouts used by the CPU_REPACK buffer type while loading the model
+    // `progressCallback` is forwarded to llama.cpp's model loader and is invoked with values in [0, 1].
+    // Returning `false` from the callback aborts the load, in which case a std::runtime_error is thrown.
     void loadModel(const char* modelPath, float minP, float temperature, bool storeChats, long contextSize,
-                   const char* chatTemplate, int nThreads, bool useMmap, bool useMlock);
+                   const char* chatTemplate, int nThreads, bool useMmap, bool useMlock, bool repackWeights = true,
+                   bool prefetch = false, bool warmup = false, llama_progress_callback progressCallback = nullptr,
+                   void* progressCallbackUserData = nullptr);
+
+    // rebuilds the sampler for the given parameters, resetting its state (RNG, penalty history)
+    // throws std::invalid_argument for invalid parameters, keeping the current sampler
+    void setSamplerParams(const SamplerParams& params);
 
     void addChatMessage(const char* message, const char* role);
 
@@ -61,6 +104,8 @@ public:
 
     int getContextSizeUsed() const;
 
+    const std::string& getLastPrompt() const;
+
     void startCompletion(const char* query);
 
     std::string completionLoop();
@@ -0,0 +1,34 @@
+#include "MessageArena.h"
+#include <algorithm>
+#include <cstring>
+
+const char*
+MessageArena::store(const char* str, size_t len) {
+    const size_t required = len + 1;
+    while (_currBlock < _blocks.size() && _blocks[_currBlock].size - _blocks[_currBlock].used < required) {
+        _currBlock += 1;
+    }
+    if (_currBlock == _blocks.size()) {
+        const size_t size = std::max(BLOCK_SIZE, required);
+        _blocks.push_back({ std::make_unique<char[]>(size), size, 0 });
+    }
+    Block& block = _blocks[_currBlock];
+    char*  dest  = block.data.get() + block.used;
+    memcpy(dest, str, len);
+    dest[len] = '\0';
+    block.used += required;
+    return dest;
+}
+
+const char*
+MessageArena::store(const char* str) {
+    return store(str, strlen(str));
+}
+
+void
+MessageArena::clear() {
+    for (Block& block : _blocks) {
+        block.used = 0;
+    }
+    _currBlock = 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Append-only storage for the role/content strings of the chat messages.
+// Strings are copied into blocks that are never reallocated, so the pointers
+// returned by `store()` remain valid until `clear()` is called.
+class MessageArena {
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t                  size;
+        size_t                  used;
+    };
+
+    std::vector<Block> _blocks;
+    // index of the block in which the next string is stored
+    size_t _currBlock = 0;
+
+public:
+    // copies `len` bytes of `str` followed by a null-terminator and returns the copy
+    const char* store(const char* str, size_t len);
+
+    const char* store(const char* str);
+
+    // invalidates all stored strings, the blocks are retained for reuse
+    void clear();
+};
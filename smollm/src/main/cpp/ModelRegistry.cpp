@@ -0,0 +1,151 @@
+#include "ModelRegistry.h"
+#include <algorithm>
+#include <android/log.h>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TAG "[SmolLMAndroid-Cpp]"
+#define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+
+ModelRegistry&
+ModelRegistry::getInstance() {
+    static ModelRegistry instance;
+    return instance;
+}
+
+void
+ModelRegistry::_prefetchModelFile(const char* modelPath) {
+    int fd = open(modelPath, O_RDONLY);
+    if (fd < 0) {
+        LOGe("prefetch: failed to open %s", modelPath);
+        return;
+    }
+    // POSIX_FADV_WILLNEED starts an asynchronous readahead of the complete file (len = 0), the pages
+    // land in the page-cache that is shared with llama.cpp's mmap. The GGUF header is not parsed to
+    // skip the metadata, as that would read the (large) vocabulary arrays a second time
+    int err = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    if (err != 0) {
+        LOGe("prefetch: posix_fadvise() failed with error %d", err);
+    } else {
+        LOGi("prefetch: requested readahead of %s", modelPath);
+    }
+    close(fd);
+}
+
+void
+ModelRegistry::_evictIdleModels(size_t incomingBytes) {
+    size_t totalBytes = incomingBytes;
+    for (const Entry& entry : _entries) {
+        totalBytes += entry.sizeBytes;
+    }
+    for (auto it = _entries.rbegin(); it != _entries.rend() && totalBytes > _memoryBudget;) {
+        if (it->refCount > 0) {
+            ++it;
+            continue;
+        }
+        LOGi("ModelRegistry: evicting %s (%zu bytes)", it->modelPath.c_str(), it->sizeBytes);
+        llama_model_free(it->model);
+        totalBytes -= it->sizeBytes;
+        it = std::list<Entry>::reverse_iterator(_entries.erase(std::next(it).base()));
+    }
+}
+
+std::list<ModelRegistry::Entry>::iterator
+ModelRegistry::_findEntry(const char* modelPath, const llama_model_params& params) {
+    return std::find_if(_entries.begin(), _entries.end(), [&](const Entry& entry) {
+        return entry.modelPath == modelPath && entry.useMmap == params.use_mmap && entry.useMlock == params.use_mlock &&
+               entry.useExtraBufts == params.use_extra_bufts && entry.nGpuLayers == params.n_gpu_layers;
+    });
+}
+
+llama_model*
+ModelRegistry::acquire(const char* modelPath, const llama_model_params& params, bool prefetch) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto                         it = _findEntry(modelPath, params);
+    while (it != _entries.end() && it->loading) {
+        // another thread is loading the same model, wait for it and look it up again
+        // as the entry is removed if the load fails
+        _loadedCondition.wait(lock);
+        it = _findEntry(modelPath, params);
+    }
+    if (it != _entries.end()) {
+        it->refCount += 1;
+        // move the entry to the front, marking it as the most recently used
+        _entries.splice(_entries.begin(), _entries, it);
+        LOGi("ModelRegistry: reusing %s, refCount = %d", modelPath, it->refCount);
+        llama_model* model = it->model;
+        lock.unlock();
+        if (params.progress_callback && !params.progress_callback(1.0f, params.progress_callback_user_data)) {
+            // the load was aborted by the callback, as llama.cpp does for a model loaded from the disk
+            LOGi("ModelRegistry: load of %s aborted by the progress callback", modelPath);
+            release(model);
+            return nullptr;
+        }
+        return model;
+    }
+
+    // make room for the new model before loading it,
+    // using the file size as an estimate of the model's size
+    struct stat fileStat {};
+    size_t      fileSize = stat(modelPath, &fileStat) == 0 ? (size_t) fileStat.st_size : 0;
+    _evictIdleModels(fileSize);
+
+    // the entry is referenced while it is loading, hence it is not evicted
+    // and its iterator remains valid once the lock is acquired again
+    _entries.push_front({ modelPath, params.use_mmap, params.use_mlock, params.use_extra_bufts, params.n_gpu_layers,
+                          nullptr, fileSize, 1, true });
+    auto loadingEntry = _entries.begin();
+    lock.unlock();
+
+    // the progress callback calls into Kotlin, which may close other
+    // instances or change the budget, hence the load runs without the lock
+    if (prefetch && params.use_mmap) {
+        _prefetchModelFile(modelPath);
+    }
+    llama_model* model = llama_model_load_from_file(modelPath, params);
+
+    lock.lock();
+    if (!model) {
+        _entries.erase(loadingEntry);
+    } else {
+        loadingEntry->model     = model;
+        loadingEntry->sizeBytes = (size_t) llama_model_size(model);
+        loadingEntry->loading   = false;
+        LOGi("ModelRegistry: loaded %s, %zu models in registry", modelPath, _entries.size());
+    }
+    lock.unlock();
+    _loadedCondition.notify_all();
+    return model;
+}
+
+void
+ModelRegistry::release(llama_model* model) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (Entry& entry : _entries) {
+        if (entry.model == model) {
+            entry.refCount -= 1;
+            LOGi("ModelRegistry: released %s, refCount = %d", entry.modelPath.c_str(), entry.refCount);
+            break;
+        }
+    }
+    _evictIdleModels(0);
+}
+
+void
+ModelRegistry::setMemoryBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _memoryBudget = bytes;
+    _evictIdleModels(0);
+}
+
+void
+ModelRegistry::trim() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const size_t                budget = _memoryBudget;
+    _memoryBudget                      = 0;
+    _evictIdleModels(0);
+    _memoryBudget = budget;
+}
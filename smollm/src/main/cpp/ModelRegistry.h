@@ -0,0 +1,62 @@
+#pragma once
+#include "llama.h"
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+
+// Process-wide cache of loaded `llama_model` instances, shared by all `LLMInference` objects.
+// Models are keyed by their path and the load parameters that affect the loaded weights.
+// A model is freed only when no `LLMInference` holds it and it no longer fits in the
+// memory budget given to the idle (unreferenced) models, the least recently used first.
+class ModelRegistry {
+    struct Entry {
+        std::string  modelPath;
+        bool         useMmap;
+        bool         useMlock;
+        bool         useExtraBufts;
+        int          nGpuLayers;
+        llama_model* model;
+        size_t       sizeBytes;
+        int          refCount;
+        // set while the model is loaded outside `_mutex`, `model` is nullptr until then
+        bool loading;
+    };
+
+    std::mutex _mutex;
+    // notified when a model finishes loading (or fails to load)
+    std::condition_variable _loadedCondition;
+    // ordered from the most recently used to the least recently used
+    std::list<Entry> _entries;
+    // idle models are freed immediately unless a budget is set with `setMemoryBudget()`
+    size_t _memoryBudget = 0;
+
+    std::list<Entry>::iterator _findEntry(const char* modelPath, const llama_model_params& params);
+
+    ModelRegistry() = default;
+
+    // frees idle models, least recently used first, until the total size
+    // of all loaded models plus `incomingBytes` fits in `_memoryBudget`
+    void _evictIdleModels(size_t incomingBytes);
+
+    static void _prefetchModelFile(const char* modelPath);
+
+public:
+    static ModelRegistry& getInstance();
+
+    // returns a loaded model for the given path and params, loading it from the disk if it is not cached
+    // the returned model must be handed back with `release()`, returns nullptr if the model could not be loaded
+    // the model is loaded without holding the registry's lock, concurrent calls for the same model wait for it
+    llama_model* acquire(const char* modelPath, const llama_model_params& params, bool prefetch);
+
+    void release(llama_model* model);
+
+    void setMemoryBudget(size_t bytes);
+
+    // frees all idle models regardless of the budget, e.g. when the system is low on memory
+    void trim();
+
+    ModelRegistry(const ModelRegistry&)            = delete;
+    ModelRegistry& operator=(const ModelRegistry&) = delete;
+};
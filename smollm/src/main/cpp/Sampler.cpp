@@ -0,0 +1,121 @@
+#include "Sampler.h"
+#include <algorithm>
+#include <cmath>
+
+bool
+SamplerParams::supportsFusedSampling() const {
+    bool hasPenalties =
+        penaltyLastN != 0 && (repeatPenalty != 1.0f || frequencyPenalty != 0.0f || presencePenalty != 0.0f);
+    if (hasPenalties || mirostat != 0) return false;
+    if (greedy) return true;
+    return topK > 0 && topP >= 1.0f && typicalP >= 1.0f;
+}
+
+void
+SamplerParams::validate() const {
+    if (mirostat < 0 || mirostat > 2) {
+        throw std::invalid_argument("mirostat must be 0 (disabled), 1 or 2");
+    }
+    if (topK < 0) {
+        throw std::invalid_argument("topK must not be negative");
+    }
+    if (minP < 0.0f) {
+        throw std::invalid_argument("minP must not be negative");
+    }
+}
+
+llama_sampler*
+createSamplerChain(const llama_model* model, const SamplerParams& params) {
+    llama_sampler_chain_params chain_params = llama_sampler_chain_default_params();
+    chain_params.no_perf                    = true;
+    llama_sampler* sampler                  = llama_sampler_chain_init(chain_params);
+
+    // penalties are applied first, as in llama.cpp's common sampler
+    if (params.repeatPenalty != 1.0f || params.frequencyPenalty != 0.0f || params.presencePenalty != 0.0f) {
+        llama_sampler_chain_add(sampler,
+                                llama_sampler_init_penalties(params.penaltyLastN, params.repeatPenalty,
+                                                             params.frequencyPenalty, params.presencePenalty));
+    }
+    if (params.greedy) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
+    } else if (params.mirostat == 1) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_temp(params.temperature));
+        llama_sampler_chain_add(sampler,
+                                llama_sampler_init_mirostat(llama_vocab_n_tokens(llama_model_get_vocab(model)),
+                                                            params.seed, params.mirostatTau, params.mirostatEta, 100));
+    } else if (params.mirostat == 2) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_temp(params.temperature));
+        llama_sampler_chain_add(sampler,
+                                llama_sampler_init_mirostat_v2(params.seed, params.mirostatTau, params.mirostatEta));
+    } else {
+        if (params.topK > 0) llama_sampler_chain_add(sampler, llama_sampler_init_top_k(params.topK));
+        if (params.typicalP < 1.0f) llama_sampler_chain_add(sampler, llama_sampler_init_typical(params.typicalP, 1));
+        if (params.topP < 1.0f) llama_sampler_chain_add(sampler, llama_sampler_init_top_p(params.topP, 1));
+        llama_sampler_chain_add(sampler, llama_sampler_init_min_p(params.minP, 1));
+        llama_sampler_chain_add(sampler, llama_sampler_init_temp(params.temperature));
+        llama_sampler_chain_add(sampler, llama_sampler_init_dist(params.seed));
+    }
+    return sampler;
+}
+
+static bool
+compareLogitsGreater(const llama_token_data& a, const llama_token_data& b) {
+    return a.logit > b.logit;
+}
+
+FusedSampler::FusedSampler(const SamplerParams& params) : _params(params) {
+    _rng.seed(params.seed == LLAMA_DEFAULT_SEED ? std::random_device{}() : params.seed);
+    if (params.topK > 0) {
+        _candidates.reserve(params.topK);
+    }
+}
+
+llama_token
+FusedSampler::sample(const float* logits, int32_t nVocab) {
+    if (_params.greedy || _params.temperature <= 0.0f) {
+        return (llama_token) (std::max_element(logits, logits + nVocab) - logits);
+    }
+
+    // select the top-k logits in a single pass, keeping the smallest of them at the front of the heap
+    // most logits are smaller than the heap's minimum and are rejected with a single comparison
+    const size_t k = std::min((size_t) _params.topK, (size_t) nVocab);
+    _candidates.clear();
+    for (llama_token id = 0; id < (llama_token) k; ++id) {
+        _candidates.push_back({ id, logits[id], 0.0f });
+    }
+    std::make_heap(_candidates.begin(), _candidates.end(), compareLogitsGreater);
+    for (llama_token id = (llama_token) k; id < nVocab; ++id) {
+        if (logits[id] > _candidates.front().logit) {
+            std::pop_heap(_candidates.begin(), _candidates.end(), compareLogitsGreater);
+            _candidates.back() = { id, logits[id], 0.0f };
+            std::push_heap(_candidates.begin(), _candidates.end(), compareLogitsGreater);
+        }
+    }
+
+    float maxLogit = -INFINITY;
+    for (const llama_token_data& candidate : _candidates) {
+        maxLogit = std::max(maxLogit, candidate.logit);
+    }
+
+    // min-p: p / p_max >= minP  <=>  logit >= maxLogit + log(minP)
+    // temperature is applied after min-p, hence the threshold is computed on the raw logits
+    const float minLogit = _params.minP > 0.0f ? maxLogit + logf(_params.minP) : -INFINITY;
+    float       sum      = 0.0f;
+    for (llama_token_data& candidate : _candidates) {
+        candidate.p = candidate.logit >= minLogit ? expf((candidate.logit - maxLogit) / _params.temperature) : 0.0f;
+        sum += candidate.p;
+    }
+
+    std::uniform_real_distribution<float> distribution(0.0f, sum);
+    float                                 target = distribution(_rng);
+    for (const llama_token_data& candidate : _candidates) {
+        target -= candidate.p;
+        if (target <= 0.0f && candidate.p > 0.0f) {
+            return candidate.id;
+        }
+    }
+    // rounding errors may leave `target` positive, select the most probable token
+    return std::max_element(_candidates.begin(), _candidates.end(),
+                            [](const llama_token_data& a, const llama_token_data& b) { return a.logit < b.logit; })
+        ->id;
+}
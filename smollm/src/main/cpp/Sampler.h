@@ -0,0 +1,52 @@
+#pragma once
+#include "llama.h"
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+// Parameters of the sampler chain used to select the next token
+// Defaults match the chain top_k(40) -> min_p -> temp -> dist
+struct SamplerParams {
+    float    minP             = 0.1f;
+    float    temperature      = 0.8f;
+    int32_t  topK             = 40;
+    float    topP             = 1.0f;
+    float    typicalP         = 1.0f;
+    int32_t  penaltyLastN     = 64;
+    float    repeatPenalty    = 1.0f;
+    float    frequencyPenalty = 0.0f;
+    float    presencePenalty  = 0.0f;
+    // 0 = disabled, 1 = Mirostat, 2 = Mirostat 2.0
+    int32_t  mirostat         = 0;
+    float    mirostatTau      = 5.0f;
+    float    mirostatEta      = 0.1f;
+    uint32_t seed             = LLAMA_DEFAULT_SEED;
+    bool     greedy           = false;
+
+    // whether the parameters can be sampled with `FusedSampler`
+    // i.e. only top-k, min-p and temperature (or greedy) are used
+    bool supportsFusedSampling() const;
+
+    // throws std::invalid_argument if a parameter is out of its range
+    void validate() const;
+};
+
+// builds the llama.cpp sampler chain for the given parameters
+llama_sampler* createSamplerChain(const llama_model* model, const SamplerParams& params);
+
+// Samples directly from the logits with top-k -> min-p -> temp -> dist in a single pass over the vocabulary,
+// instead of building a llama_token_data_array for the complete vocabulary and walking it in each stage
+// of the sampler chain. The sampled tokens follow the same distribution as the chain, but for a given seed
+// the sequence differs from the one produced by the chain.
+class FusedSampler {
+    SamplerParams _params;
+    std::mt19937  _rng;
+    // min-heap holding the top-k candidates, reused across calls
+    std::vector<llama_token_data> _candidates;
+
+public:
+    explicit FusedSampler(const SamplerParams& params);
+
+    llama_token sample(const float* logits, int32_t nVocab);
+};
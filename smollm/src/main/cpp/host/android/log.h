@@ -0,0 +1,21 @@
+#pragma once
+// Shim for <android/log.h> used by the host (non-Android) build,
+// printing the log messages to stderr instead of logcat
+#include <cstdarg>
+#include <cstdio>
+
+enum {
+    ANDROID_LOG_INFO  = 4,
+    ANDROID_LOG_ERROR = 6,
+};
+
+static inline int
+__android_log_print(int prio, const char* tag, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s %s: ", prio == ANDROID_LOG_ERROR ? "E" : "I", tag);
+    int written = vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    return written;
+}
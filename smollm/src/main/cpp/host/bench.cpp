@@ -0,0 +1,75 @@
+// Host benchmark for LLMInference, used to compare the CPU kernels (with and without
+// weight repacking) off-device. See docs/build_arm_flags.md for building it.
+//
+// usage: smollm_bench <model.gguf> [nThreads] [nPromptRepeats] [nPredict]
+#include "LLMInference.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+static double
+elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void
+runBenchmark(const char* modelPath, bool repackWeights, int nThreads, const std::string& prompt, int nPredict) {
+    auto llmInference = std::make_unique<LLMInference>();
+
+    auto start = std::chrono::steady_clock::now();
+    llmInference->loadModel(modelPath, 0.1f, 0.8f, false, 4096, nullptr, nThreads, true, false, repackWeights,
+                            false, true);
+    double loadMs = elapsedMs(start);
+
+    SamplerParams samplerParams;
+    samplerParams.greedy = true;
+    llmInference->setSamplerParams(samplerParams);
+
+    // the first call to completionLoop() decodes the prompt
+    llmInference->startCompletion(prompt.c_str());
+    start                 = std::chrono::steady_clock::now();
+    std::string piece     = llmInference->completionLoop();
+    double      prefillMs = elapsedMs(start);
+    int         nPrompt   = llmInference->getContextSizeUsed();
+
+    int nGenerated = 0;
+    start          = std::chrono::steady_clock::now();
+    while (nGenerated < nPredict && piece != "[EOG]") {
+        piece = llmInference->completionLoop();
+        nGenerated += 1;
+    }
+    double decodeMs = elapsedMs(start);
+    llmInference->stopCompletion();
+
+    printf("repackWeights = %d: load = %.1f ms, prefill = %.2f tokens/s (%d tokens), decode = %.2f tokens/s (%d "
+           "tokens)\n",
+           repackWeights, loadMs, nPrompt / (prefillMs / 1e3), nPrompt, nGenerated / (decodeMs / 1e3), nGenerated);
+}
+
+int
+main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <model.gguf> [nThreads] [nPromptRepeats] [nPredict]\n", argv[0]);
+        return 1;
+    }
+    const char* modelPath      = argv[1];
+    int         nThreads       = argc > 2 ? atoi(argv[2]) : 4;
+    int         nPromptRepeats = argc > 3 ? atoi(argv[3]) : 32;
+    int         nPredict       = argc > 4 ? atoi(argv[4]) : 64;
+
+    std::string prompt = "Summarize the following text: ";
+    for (int i = 0; i < nPromptRepeats; ++i) {
+        prompt += "The quick brown fox jumps over the lazy dog. ";
+    }
+
+    try {
+        runBenchmark(modelPath, false, nThreads, prompt, nPredict);
+        runBenchmark(modelPath, true, nThreads, prompt, nPredict);
+    } catch (std::exception& error) {
+        fprintf(stderr, "benchmark failed: %s\n", error.what());
+        return 1;
+    }
+    return 0;
+}
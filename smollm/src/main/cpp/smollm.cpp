@@ -1,24 +1,72 @@
 #include "LLMInference.h"
+#include "ModelRegistry.h"
 #include <jni.h>
 #include <android/log.h>
 
 #define TAG "[SmolLM-JNI]"
 #define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
 
+// state passed to llama.cpp's model loader to forward
+// the load progress to a Kotlin `SmolLM.LoadProgressListener`
+struct LoadProgressState {
+    JNIEnv*   env;
+    jobject   listener;
+    jmethodID onProgressMethod;
+};
+
+static bool
+loadProgressCallback(float progress, void* userData) {
+    auto* state = static_cast<LoadProgressState*>(userData);
+    jboolean shouldContinue = state->env->CallBooleanMethod(state->listener, state->onProgressMethod, progress);
+    if (state->env->ExceptionCheck()) {
+        // abort the load, the pending exception is rethrown in Kotlin
+        return false;
+    }
+    return shouldContinue == JNI_TRUE;
+}
+
 extern "C" JNIEXPORT jlong JNICALL
 Java_io_shubham0204_smollm_SmolLM_loadModel(JNIEnv* env, jobject thiz, jstring modelPath, jfloat minP,
                                             jfloat temperature, jboolean storeChats, jlong contextSize,
-                                            jstring chatTemplate, jint nThreads, jboolean useMmap, jboolean useMlock) {
+                                            jstring chatTemplate, jint nThreads, jboolean useMmap, jboolean useMlock,
+                                            jboolean repackWeights, jboolean prefetch, jboolean warmup,
+                                            jobject progressListener) {
     jboolean    isCopy           = true;
     const char* modelPathCstr    = env->GetStringUTFChars(modelPath, &isCopy);
     auto*       llmInference     = new LLMInference();
     const char* chatTemplateCstr = env->GetStringUTFChars(chatTemplate, &isCopy);
 
+    LoadProgressState progressState{};
+    if (progressListener != nullptr) {
+        jclass listenerClass            = env->GetObjectClass(progressListener);
+        progressState.env              = env;
+        progressState.listener         = progressListener;
+        progressState.onProgressMethod = env->GetMethodID(listenerClass, "onProgress", "(F)Z");
+        env->DeleteLocalRef(listenerClass);
+    }
+
     try {
         llmInference->loadModel(modelPathCstr, minP, temperature, storeChats, contextSize, chatTemplateCstr, nThreads,
-                                useMmap, useMlock);
+                                useMmap, useMlock, repackWeights, prefetch, warmup,
+                                progressListener != nullptr ? loadProgressCallback : nullptr,
+                                progressListener != nullptr ? &progressState : nullptr);
+    } catch (std::invalid_argument& error) {
+        delete llmInference;
+        llmInference = nullptr;
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), error.what());
     } catch (std::runtime_error& error) {
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        delete llmInference;
+        llmInference = nullptr;
+        // an exception thrown by the listener takes precedence
+        if (!env->ExceptionCheck()) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error.what());
+        }
+    }
+    if (llmInference != nullptr && env->ExceptionCheck()) {
+        // the listener threw after the load completed (e.g. for the final progress update),
+        // the instance is never handed to Kotlin, hence it is freed here
+        delete llmInference;
+        llmInference = nullptr;
     }
 
     env->ReleaseStringUTFChars(modelPath, modelPathCstr);
@@ -26,6 +74,36 @@ Java_io_shubham0204_smollm_SmolLM_loadModel(JNIEnv* env, jobject thiz, jstring m
     return reinterpret_cast<jlong>(llmInference);
 }
 
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_setSamplerParams(JNIEnv* env, jobject thiz, jlong modelPtr, jfloat minP,
+                                                   jfloat temperature, jint topK, jfloat topP, jfloat typicalP,
+                                                   jint penaltyLastN, jfloat repeatPenalty, jfloat frequencyPenalty,
+                                                   jfloat presencePenalty, jint mirostat, jfloat mirostatTau,
+                                                   jfloat mirostatEta, jint seed, jboolean greedy) {
+    auto*         llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    SamplerParams params;
+    params.minP             = minP;
+    params.temperature      = temperature;
+    params.topK             = topK;
+    params.topP             = topP;
+    params.typicalP         = typicalP;
+    params.penaltyLastN     = penaltyLastN;
+    params.repeatPenalty    = repeatPenalty;
+    params.frequencyPenalty = frequencyPenalty;
+    params.presencePenalty  = presencePenalty;
+    params.mirostat         = mirostat;
+    params.mirostatTau      = mirostatTau;
+    params.mirostatEta      = mirostatEta;
+    // a seed of -1 maps to LLAMA_DEFAULT_SEED (0xFFFFFFFF), which selects a random seed
+    params.seed   = static_cast<uint32_t>(seed);
+    params.greedy = greedy;
+    try {
+        llmInference->setSamplerParams(params);
+    } catch (std::invalid_argument& error) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), error.what());
+    }
+}
+
 extern "C" JNIEXPORT void JNICALL
 Java_io_shubham0204_smollm_SmolLM_addChatMessage(JNIEnv* env, jobject thiz, jlong modelPtr, jstring message,
                                                  jstring role) {
@@ -50,6 +128,53 @@ Java_io_shubham0204_smollm_SmolLM_getContextSizeUsed(JNIEnv* env, jobject thiz,
     return llmInference->getContextSizeUsed();
 }
 
+extern "C" JNIEXPORT jstring JNICALL
+Java_io_shubham0204_smollm_SmolLM_getLastPrompt(JNIEnv* env, jobject thiz, jlong modelPtr) {
+    auto* llmInference = reinterpret_cast<LLMInference*>(modelPtr);
+    return env->NewStringUTF(llmInference->getLastPrompt().c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_io_shubham0204_smollm_SmolLM_applyChatTemplate(JNIEnv* env, jobject thiz, jstring chatTemplate,
+                                                    jobjectArray roles, jobjectArray contents,
+                                                    jboolean addAssistant) {
+    jboolean    isCopy           = true;
+    const char* chatTemplateCstr = env->GetStringUTFChars(chatTemplate, &isCopy);
+    jsize       numMessages      = env->GetArrayLength(roles);
+
+    std::vector<std::string> rolesStr, contentsStr;
+    for (jsize i = 0; i < numMessages; ++i) {
+        auto        role        = (jstring) env->GetObjectArrayElement(roles, i);
+        auto        content     = (jstring) env->GetObjectArrayElement(contents, i);
+        const char* roleCstr    = env->GetStringUTFChars(role, &isCopy);
+        const char* contentCstr = env->GetStringUTFChars(content, &isCopy);
+        rolesStr.emplace_back(roleCstr);
+        contentsStr.emplace_back(contentCstr);
+        env->ReleaseStringUTFChars(role, roleCstr);
+        env->ReleaseStringUTFChars(content, contentCstr);
+        env->DeleteLocalRef(role);
+        env->DeleteLocalRef(content);
+    }
+    std::vector<llama_chat_message> messages;
+    for (jsize i = 0; i < numMessages; ++i) {
+        messages.push_back({ rolesStr[i].c_str(), contentsStr[i].c_str() });
+    }
+
+    int32_t len = llama_chat_apply_template(chatTemplateCstr, messages.data(), messages.size(), addAssistant,
+                                            nullptr, 0);
+    std::vector<char> formatted(len > 0 ? len : 0);
+    if (len > 0) {
+        llama_chat_apply_template(chatTemplateCstr, messages.data(), messages.size(), addAssistant, formatted.data(),
+                                  formatted.size());
+    }
+    env->ReleaseStringUTFChars(chatTemplate, chatTemplateCstr);
+    if (len < 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "llama_chat_apply_template() failed");
+        return nullptr;
+    }
+    return env->NewStringUTF(std::string(formatted.begin(), formatted.end()).c_str());
+}
+
 extern "C" JNIEXPORT void JNICALL
 Java_io_shubham0204_smollm_SmolLM_close(JNIEnv* env, jobject thiz, jlong modelPtr) {
     LOGi("close, modelPtr: %ld", modelPtr);
@@ -57,6 +182,18 @@ Java_io_shubham0204_smollm_SmolLM_close(JNIEnv* env, jobject thiz, jlong modelPt
     delete llmInference;
 }
 
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_setModelCacheBudget(JNIEnv* env, jclass clazz, jlong budgetBytes) {
+    LOGi("setModelCacheBudget, budgetBytes: %ld", budgetBytes);
+    ModelRegistry::getInstance().setMemoryBudget(budgetBytes > 0 ? (size_t) budgetBytes : 0);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_io_shubham0204_smollm_SmolLM_trimModelCache(JNIEnv* env, jclass clazz) {
+    LOGi("trimModelCache");
+    ModelRegistry::getInstance().trim();
+}
+
 extern "C" JNIEXPORT void JNICALL
 Java_io_shubham0204_smollm_SmolLM_startCompletion(JNIEnv* env, jobject thiz, jlong modelPtr, jstring prompt) {
     jboolean    isCopy       = true;
@@ -2,9 +2,12 @@ package io.shubham0204.smollm
 
 import android.os.Build
 import android.util.Log
+import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.ensureActive
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.flow
+import kotlinx.coroutines.isActive
 import kotlinx.coroutines.withContext
 import java.io.File
 import java.io.FileNotFoundException
@@ -45,7 +48,16 @@ class SmolLM {
                 (Build.HARDWARE.contains("goldfish") || Build.HARDWARE.contains("ranchu"))
             Log.d(logTag, "isEmulated: $isEmulated")
 
-            if (!isEmulated) {
+            // x86_64 devices, emulators and hosts that support AVX2 use the
+            // build with the AVX2 kernels for the repacked weights
+            val x86Flags = getX86CPUFlags()
+            val hasAvx2 = x86Flags.contains("avx2") && x86Flags.contains("fma") && x86Flags.contains("f16c")
+            Log.d(logTag, "- hasAvx2: $hasAvx2")
+
+            if (supportsX86_64() && hasAvx2) {
+                Log.d(logTag, "Loading libsmollm_x86_64_avx2.so")
+                System.loadLibrary("smollm_x86_64_avx2")
+            } else if (!isEmulated) {
                 if (supportsArm64V8a()) {
                     if (isAtLeastArmV84 && hasSve && hasI8mm && hasFp16 && hasDotProd) {
                         Log.d(logTag, "Loading libsmollm_v8_4_fp16_dotprod_i8mm_sve.so")
@@ -99,7 +111,38 @@ class SmolLM {
             return cpuFeatures
         }
 
+        /**
+         * Reads the /proc/cpuinfo file and returns the line starting with 'flags :' containing the
+         * CPU features of an x86 CPU
+         */
+        private fun getX86CPUFlags(): List<String> {
+            val cpuInfo =
+                try {
+                    File("/proc/cpuinfo").readText()
+                } catch (e: FileNotFoundException) {
+                    ""
+                }
+            val flagsLine = cpuInfo.lineSequence().firstOrNull { it.startsWith("flags") } ?: return emptyList()
+            return flagsLine.substringAfter(":").trim().split(" ")
+        }
+
         private fun supportsArm64V8a(): Boolean = Build.SUPPORTED_ABIS[0].equals("arm64-v8a")
+
+        private fun supportsX86_64(): Boolean = Build.SUPPORTED_ABIS[0].equals("x86_64")
+
+        /**
+         * Loaded models are shared by all [SmolLM] instances that use the same model file and load
+         * params, so that switching between them only creates a new context. Models that are no
+         * longer used by any instance are kept loaded, least recently used first, as long as the
+         * size of all loaded models stays within [budgetBytes]. Defaults to `0`, freeing models as
+         * soon as they are closed. Repacked weights are not backed by the model file and cannot be
+         * reclaimed by the system, hence apps setting a budget should call [trimModelCache] from
+         * `onTrimMemory`.
+         */
+        @JvmStatic external fun setModelCacheBudget(budgetBytes: Long)
+
+        /** Frees all models that are not used by any [SmolLM] instance, regardless of the budget. */
+        @JvmStatic external fun trimModelCache()
     }
 
     // Native LLMInference pointer
@@ -126,9 +169,68 @@ class SmolLM {
         val numThreads: Int = 4,
         val useMmap: Boolean = true,
         val useMlock: Boolean = false,
+        // repack Q4_0/IQ4_NL weights in interleaved layouts for faster CPU matmuls
+        val repackWeights: Boolean = true,
+        // off by default: llama.cpp already advises the kernel to read ahead the mmap-ed model
+        val prefetchWeights: Boolean = false,
+        val warmup: Boolean = true,
+        // if set, overrides `minP` and `temperature`
+        val samplerParams: SamplerParams? = null,
+    )
+
+    /**
+     * Parameters of the sampler that selects the next token. With the defaults (and any other
+     * combination of only [topK], [minP] and [temperature], or [greedy]) a fused native sampler is
+     * used that selects the candidates in a single pass over the logits. Enabling penalties,
+     * [topP], [typicalP] or [mirostat] uses llama.cpp's sampler chain. A [seed] of `-1` selects a
+     * random seed, any other value gives reproducible responses for the same model and query.
+     */
+    data class SamplerParams(
+        val minP: Float = 0.1f,
+        val temperature: Float = 0.8f,
+        val topK: Int = 40,
+        val topP: Float = 1.0f,
+        val typicalP: Float = 1.0f,
+        val penaltyLastN: Int = 64,
+        val repeatPenalty: Float = 1.0f,
+        val frequencyPenalty: Float = 0.0f,
+        val presencePenalty: Float = 0.0f,
+        // 0 = disabled, 1 = Mirostat, 2 = Mirostat 2.0
+        val mirostat: Int = 0,
+        val mirostatTau: Float = 5.0f,
+        val mirostatEta: Float = 0.1f,
+        val seed: Int = -1,
+        val greedy: Boolean = false,
     )
 
-    suspend fun load(modelPath: String, params: InferenceParams = InferenceParams()) =
+    /**
+     * Receives the progress of the model loading with values in [0, 1]. Return `false` to abort
+     * the load. It is invoked on the [Dispatchers.IO] thread running [SmolLM.load] while the
+     * instance's lock is held, hence it must not update views directly (post to the main thread
+     * instead) and must not call other methods of the same [SmolLM] instance.
+     */
+    fun interface LoadProgressListener {
+        fun onProgress(progress: Float): Boolean
+    }
+
+    /**
+     * Loads the GGUF model at [modelPath] on [Dispatchers.IO].
+     *
+     * If [InferenceParams.prefetchWeights] is set (and `useMmap` is enabled), an asynchronous
+     * readahead of the model file into the page-cache is requested before llama.cpp loads the
+     * model. On Linux/Android, llama.cpp's mmap already requests a readahead of the complete file,
+     * hence this is only a hint for other platforms or storage with slow readahead. If
+     * [InferenceParams.warmup] is set, a short decode is run after the context is created so that the
+     * first query does not pay for page-faults and compute buffer allocation. [onProgress] is invoked
+     * with the load progress in [0, 1] on the [Dispatchers.IO] thread running the load (see
+     * [LoadProgressListener]). Cancelling the calling coroutine aborts the load and throws
+     * a [CancellationException], while a failed load throws an [IllegalStateException].
+     */
+    suspend fun load(
+        modelPath: String,
+        params: InferenceParams = InferenceParams(),
+        onProgress: ((Float) -> Unit)? = null,
+    ) =
         withContext(Dispatchers.IO) {
             val ggufReader = GGUFReader()
             ggufReader.load(modelPath)
@@ -142,20 +244,70 @@ class SmolLM {
                     nativePtr = 0L
                 }
                 nativePtr =
-                    loadModel(
-                        modelPath,
-                        params.minP,
-                        params.temperature,
-                        params.storeChats,
-                        params.contextSize ?: modelContextSize,
-                        params.chatTemplate ?: modelChatTemplate,
-                        params.numThreads,
-                        params.useMmap,
-                        params.useMlock,
-                    )
+                    try {
+                        loadModel(
+                            modelPath,
+                            params.minP,
+                            params.temperature,
+                            params.storeChats,
+                            params.contextSize ?: modelContextSize,
+                            params.chatTemplate ?: modelChatTemplate,
+                            params.numThreads,
+                            params.useMmap,
+                            params.useMlock,
+                            params.repackWeights,
+                            params.prefetchWeights,
+                            params.warmup,
+                            LoadProgressListener { progress ->
+                                onProgress?.invoke(progress)
+                                isActive
+                            },
+                        )
+                    } catch (e: IllegalStateException) {
+                        // the listener returns false once the coroutine is cancelled, which
+                        // aborts the native load, report it as a cancellation and not a failure
+                        ensureActive()
+                        throw e
+                    }
+                try {
+                    params.samplerParams?.let { setSamplerParams(nativePtr, it) }
+                } catch (e: IllegalArgumentException) {
+                    // the load is all-or-nothing, do not leave the model loaded with the default sampler
+                    close(nativePtr)
+                    nativePtr = 0L
+                    throw e
+                }
             }
         }
 
+    /**
+     * Replaces the sampler used for the following responses. The state of the previous sampler
+     * (RNG, penalized tokens) is discarded.
+     */
+    fun setSamplerParams(params: SamplerParams) = ptrLock.withLock {
+        verifyHandle()
+        setSamplerParams(nativePtr, params)
+    }
+
+    private fun setSamplerParams(modelPtr: Long, params: SamplerParams) =
+        setSamplerParams(
+            modelPtr,
+            params.minP,
+            params.temperature,
+            params.topK,
+            params.topP,
+            params.typicalP,
+            params.penaltyLastN,
+            params.repeatPenalty,
+            params.frequencyPenalty,
+            params.presencePenalty,
+            params.mirostat,
+            params.mirostatTau,
+            params.mirostatEta,
+            params.seed,
+            params.greedy,
+        )
+
     fun addUserMessage(message: String) = ptrLock.withLock {
         verifyHandle()
         addChatMessage(nativePtr, message, "user")
@@ -181,6 +333,23 @@ class SmolLM {
         return getContextSizeUsed(nativePtr)
     }
 
+    /** Returns the prompt (formatted messages) decoded for the last query */
+    internal fun getLastPrompt(): String = ptrLock.withLock {
+        verifyHandle()
+        return getLastPrompt(nativePtr)
+    }
+
+    /**
+     * Applies the built-in llama.cpp chat-template matching [chatTemplate] to the messages with
+     * the given [roles] and [contents], returning the formatted chat
+     */
+    internal fun formatChat(
+        chatTemplate: String,
+        roles: List<String>,
+        contents: List<String>,
+        addAssistant: Boolean,
+    ): String = applyChatTemplate(chatTemplate, roles.toTypedArray(), contents.toTypedArray(), addAssistant)
+
     fun getResponseAsFlow(query: String): Flow<String> = flow {
         ptrLock.withLock {
             verifyHandle()
@@ -256,14 +425,45 @@ class SmolLM {
         nThreads: Int,
         useMmap: Boolean,
         useMlock: Boolean,
+        repackWeights: Boolean,
+        prefetch: Boolean,
+        warmup: Boolean,
+        progressListener: LoadProgressListener?,
     ): Long
 
+    private external fun setSamplerParams(
+        modelPtr: Long,
+        minP: Float,
+        temperature: Float,
+        topK: Int,
+        topP: Float,
+        typicalP: Float,
+        penaltyLastN: Int,
+        repeatPenalty: Float,
+        frequencyPenalty: Float,
+        presencePenalty: Float,
+        mirostat: Int,
+        mirostatTau: Float,
+        mirostatEta: Float,
+        seed: Int,
+        greedy: Boolean,
+    )
+
     private external fun addChatMessage(modelPtr: Long, message: String, role: String)
 
     private external fun getResponseGenerationSpeed(modelPtr: Long): Float
 
     private external fun getContextSizeUsed(modelPtr: Long): Int
 
+    private external fun getLastPrompt(modelPtr: Long): String
+
+    private external fun applyChatTemplate(
+        chatTemplate: String,
+        roles: Array<String>,
+        contents: Array<String>,
+        addAssistant: Boolean,
+    ): String
+
     private external fun close(modelPtr: Long)
 
     private external fun startCompletion(modelPtr: Long, prompt: String)